@@ -0,0 +1,199 @@
+#include "QuotaVfs.h"
+
+#include <algorithm>
+#include <chrono>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <iostream>
+#include <sqlite3.h>
+#include <sys/stat.h>
+
+using ::testing::Eq;
+using ::testing::Gt;
+using ::testing::NotNull;
+using ::testing::Test;
+
+const auto kPath = "/tmp/sqlitetest";
+const auto kJournalPath = "/tmp/sqlitetest-journal";
+const auto kBackupPath = "/tmp/sqlitetest-backup";
+const auto kIntegrityCheck = "pragma integrity_check;";
+const auto kSchema = "create table if not exists t (i text unique);";
+const auto kInsert = "insert into t (i) values ('abc');";
+const auto kInsertBlob = "insert into t (i) values (hex(randomblob(2048)));";
+const auto kCount = "select count(*) from t;";
+const auto kDelete = "delete from t;";
+const auto kBegin = "begin;";
+const auto kRollback = "rollback;";
+const auto kCapacity = 1024 * 1024;
+const auto kStep = 512;
+
+class ADbOnFullDisk : public Test {
+protected:
+    sqlite3* db;
+    void SetUp() override
+    {
+        system((std::string("rm -rf ") + kPath).c_str());
+        system((std::string("rm -rf ") + kJournalPath).c_str());
+        system((std::string("rm -rf ") + kBackupPath).c_str());
+        QuotaVfsRegister();
+        QuotaVfsSetCapacity(kQuotaUnlimited);
+        ASSERT_THAT(sqlite3_open_v2(kPath, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, kQuotaVfs), Eq(SQLITE_OK));
+        ASSERT_THAT(sqlite3_exec(db, kSchema, 0, 0, 0), Eq(SQLITE_OK));
+        EXPECT_THAT(sqlite3_exec(db, kInsert, 0, 0, 0), Eq(SQLITE_OK));
+    }
+    void TearDown() override
+    {
+        QuotaVfsSetCapacity(kQuotaUnlimited);
+        EXPECT_THAT(sqlite3_close_v2(db), Eq(SQLITE_OK));
+    }
+    // Size of the journal that sql writes before its transaction commits.
+    sqlite3_int64 JournalSize(const char* sql)
+    {
+        struct stat stat_buf;
+        EXPECT_THAT(sqlite3_exec(db, kBegin, 0, 0, 0), Eq(SQLITE_OK));
+        EXPECT_THAT(sqlite3_exec(db, sql, 0, 0, 0), Eq(SQLITE_OK));
+        EXPECT_THAT(stat(kJournalPath, &stat_buf), Eq(0));
+        EXPECT_THAT(sqlite3_exec(db, kRollback, 0, 0, 0), Eq(SQLITE_OK));
+        return stat_buf.st_size;
+    }
+    // Runs sql with kStep more free space each time until it fits, checking
+    // the reopened database after every SQLITE_FULL. Returns the failures.
+    int FailUntilFits(const char* sql, int rows)
+    {
+        for (auto failures = 0;; failures++) {
+            QuotaVfsSetCapacity(QuotaVfsUsed() + failures * kStep);
+            auto rc = sqlite3_exec(db, sql, 0, 0, 0);
+            QuotaVfsSetCapacity(kQuotaUnlimited);
+            if (rc != SQLITE_FULL) {
+                EXPECT_THAT(rc, Eq(SQLITE_OK));
+                return failures;
+            }
+            Reopen(rows);
+        }
+    }
+    // The same for a backup of the database into kBackupPath, which is
+    // checked once it fits.
+    int FailBackupUntilFits(int rows)
+    {
+        for (auto failures = 0;; failures++) {
+            sqlite3* backup;
+            EXPECT_THAT(sqlite3_open_v2(kBackupPath, &backup, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, kQuotaVfs), Eq(SQLITE_OK));
+            QuotaVfsSetCapacity(QuotaVfsUsed() + failures * kStep);
+            auto op = sqlite3_backup_init(backup, "main", db, "main");
+            EXPECT_THAT(op, NotNull());
+            auto rc = sqlite3_backup_step(op, -1);
+            EXPECT_THAT(sqlite3_backup_finish(op), Eq(rc == SQLITE_DONE ? SQLITE_OK : rc));
+            QuotaVfsSetCapacity(kQuotaUnlimited);
+            if (rc != SQLITE_FULL) {
+                EXPECT_THAT(rc, Eq(SQLITE_DONE));
+                EXPECT_THAT(sqlite3_exec(backup, kIntegrityCheck, 0, 0, 0), Eq(SQLITE_OK));
+                EXPECT_THAT(Count(backup), Eq(rows));
+                EXPECT_THAT(sqlite3_close_v2(backup), Eq(SQLITE_OK));
+                return failures;
+            }
+            EXPECT_THAT(sqlite3_close_v2(backup), Eq(SQLITE_OK));
+            Reopen(rows);
+        }
+    }
+    void Reopen(int rows)
+    {
+        EXPECT_THAT(sqlite3_close_v2(db), Eq(SQLITE_OK));
+        EXPECT_THAT(sqlite3_open_v2(kPath, &db, SQLITE_OPEN_READWRITE, kQuotaVfs), Eq(SQLITE_OK));
+        EXPECT_THAT(sqlite3_exec(db, kIntegrityCheck, 0, 0, 0), Eq(SQLITE_OK));
+        EXPECT_THAT(Count(), Eq(rows));
+    }
+    int Count()
+    {
+        return Count(db);
+    }
+    static int Count(sqlite3* conn)
+    {
+        sqlite3_stmt* stmt;
+        sqlite3_prepare_v2(conn, kCount, -1, &stmt, 0);
+        auto result = (sqlite3_step(stmt) == SQLITE_ROW) ? sqlite3_column_int(stmt, 0) : -1;
+        sqlite3_finalize(stmt);
+        return result;
+    }
+};
+
+TEST_F(ADbOnFullDisk, ReturnsFull13IfInsert)
+{
+    auto journal = JournalSize(kInsertBlob);
+
+    EXPECT_THAT(FailUntilFits(kInsertBlob, 1), Gt(journal / kStep));
+    EXPECT_THAT(Count(), Eq(2));
+}
+
+TEST_F(ADbOnFullDisk, ReturnsFull13IfDelete)
+{
+    EXPECT_THAT(FailUntilFits(kDelete, 1), Gt(0));
+    EXPECT_THAT(Count(), Eq(0));
+}
+
+TEST_F(ADbOnFullDisk, WorksIfSpaceFreed)
+{
+    QuotaVfsSetCapacity(QuotaVfsUsed() + JournalSize(kInsertBlob));
+    EXPECT_THAT(sqlite3_exec(db, kInsertBlob, 0, 0, 0), Eq(SQLITE_FULL));
+
+    QuotaVfsSetCapacity(kQuotaUnlimited);
+    EXPECT_THAT(sqlite3_close_v2(db), Eq(SQLITE_OK));
+    ASSERT_THAT(sqlite3_open_v2(kPath, &db, SQLITE_OPEN_READWRITE, kQuotaVfs), Eq(SQLITE_OK));
+
+    EXPECT_THAT(sqlite3_exec(db, kIntegrityCheck, 0, 0, 0), Eq(SQLITE_OK));
+    EXPECT_THAT(Count(), Eq(1));
+    EXPECT_THAT(sqlite3_exec(db, kInsertBlob, 0, 0, 0), Eq(SQLITE_OK));
+    EXPECT_THAT(Count(), Eq(2));
+    EXPECT_THAT(sqlite3_exec(db, kDelete, 0, 0, 0), Eq(SQLITE_OK));
+    EXPECT_THAT(Count(), Eq(0));
+}
+
+TEST_F(ADbOnFullDisk, ReturnsFull13IfBackup)
+{
+    for (auto i = 0; i < 16; i++) {
+        ASSERT_THAT(sqlite3_exec(db, kInsertBlob, 0, 0, 0), Eq(SQLITE_OK));
+    }
+
+    EXPECT_THAT(FailBackupUntilFits(17), Gt(0));
+    EXPECT_THAT(Count(), Eq(17));
+}
+
+// Times SQLite plus the quota VFS, not a real filesystem filling up.
+TEST_F(ADbOnFullDisk, ReturnsFull13IfFilled)
+{
+    QuotaVfsSetCapacity(kCapacity);
+
+    std::chrono::microseconds total[10] = {};
+    int commits[10] = {};
+    sqlite3_int64 level;
+    std::chrono::microseconds latency;
+    int rc;
+    auto rows = Count();
+    do {
+        level = std::min<sqlite3_int64>(QuotaVfsUsed() * 10 / kCapacity, 9);
+        auto start = std::chrono::steady_clock::now();
+        rc = sqlite3_exec(db, kInsertBlob, 0, 0, 0);
+        latency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+        if (rc == SQLITE_OK) {
+            total[level] += latency;
+            commits[level]++;
+            rows++;
+        }
+    } while (rc == SQLITE_OK);
+
+    EXPECT_THAT(rc, Eq(SQLITE_FULL));
+    EXPECT_THAT(rows, Gt(1));
+    EXPECT_THAT(sqlite3_exec(db, kIntegrityCheck, 0, 0, 0), Eq(SQLITE_OK));
+    EXPECT_THAT(Count(), Eq(rows));
+    for (auto i = 0; i < 10; i++) {
+        if (commits[i] > 0) {
+            std::cout << "fill " << i * 10 << "%: " << commits[i] << " commits, "
+                      << total[i].count() / commits[i] << " us/commit" << std::endl;
+        }
+    }
+    std::cout << "failed at " << level * 10 << "%: " << latency.count() << " us" << std::endl;
+
+    QuotaVfsSetCapacity(kQuotaUnlimited);
+
+    EXPECT_THAT(sqlite3_exec(db, kInsertBlob, 0, 0, 0), Eq(SQLITE_OK));
+    EXPECT_THAT(Count(), Eq(rows + 1));
+}
@@ -0,0 +1,337 @@
+#include "QuotaVfs.h"
+
+#include <chrono>
+#include <csignal>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <iostream>
+#include <sqlite3.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using ::testing::Eq;
+using ::testing::Ge;
+using ::testing::Gt;
+using ::testing::Lt;
+using ::testing::Ne;
+using ::testing::Test;
+
+const auto kPath = "/tmp/sqlitetest";
+const auto kJournalPath = "/tmp/sqlitetest-journal";
+const auto kVacuumPath = "/tmp/sqlitetest-vacuum";
+const auto kCopyPath = "/tmp/sqlitetest-copy";
+const auto kIntegrityCheck = "pragma integrity_check;";
+const auto kAutoVacuum = "pragma auto_vacuum = incremental;";
+const auto kSchema = "create table if not exists t (i text unique);";
+const auto kFill = "with recursive n(x) as (select 1 union all select x + 1 from n where x < 2000) "
+                   "insert into t (i) select hex(randomblob(512)) from n;";
+const auto kFragment = "delete from t where (rowid / 16) % 2 = 0;";
+const auto kCount = "select count(*) from t;";
+const auto kScan = "select sum(length(i)) from t;";
+const auto kFreelistCount = "pragma freelist_count;";
+const auto kVacuum = "vacuum;";
+const auto kVacuumInto = "vacuum into '/tmp/sqlitetest-vacuum';";
+const auto kIncrementalVacuum = "pragma incremental_vacuum;";
+
+class AFragmentedDb : public Test {
+protected:
+    sqlite3* db;
+    sqlite3_int64 rows;
+    sqlite3_int64 freelist;
+    std::chrono::microseconds vacuumTime;
+    sqlite3_int64 vacuumWrites;
+    void SetUp() override
+    {
+        system((std::string("rm -rf ") + kPath).c_str());
+        system((std::string("rm -rf ") + kJournalPath).c_str());
+        system((std::string("rm -rf ") + kVacuumPath).c_str());
+        system((std::string("rm -rf ") + kCopyPath).c_str());
+        QuotaVfsRegister();
+        QuotaVfsSetCapacity(kQuotaUnlimited);
+        ASSERT_THAT(sqlite3_open(kPath, &db), Eq(SQLITE_OK));
+        ASSERT_THAT(sqlite3_exec(db, kAutoVacuum, 0, 0, 0), Eq(SQLITE_OK));
+        ASSERT_THAT(sqlite3_exec(db, kSchema, 0, 0, 0), Eq(SQLITE_OK));
+        ASSERT_THAT(sqlite3_exec(db, kFill, 0, 0, 0), Eq(SQLITE_OK));
+        ASSERT_THAT(sqlite3_exec(db, kFragment, 0, 0, 0), Eq(SQLITE_OK));
+        rows = Query(kCount);
+        freelist = Query(kFreelistCount);
+        ASSERT_THAT(freelist, Gt(0));
+        ASSERT_THAT(sqlite3_close_v2(db), Eq(SQLITE_OK));
+        db = nullptr;
+    }
+    void TearDown() override
+    {
+        QuotaVfsSetCapacity(kQuotaUnlimited);
+        EXPECT_THAT(sqlite3_close_v2(db), Eq(SQLITE_OK));
+    }
+    sqlite3_int64 Query(const char* sql)
+    {
+        sqlite3_stmt* stmt;
+        sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+        auto result = (sqlite3_step(stmt) == SQLITE_ROW) ? sqlite3_column_int64(stmt, 0) : -1;
+        sqlite3_finalize(stmt);
+        return result;
+    }
+    std::string QueryText(const char* sql)
+    {
+        sqlite3_stmt* stmt;
+        sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+        auto result = (sqlite3_step(stmt) == SQLITE_ROW) ? std::string(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0))) : std::string();
+        sqlite3_finalize(stmt);
+        return result;
+    }
+    // Times a VACUUM of a copy of the database and counts its writes.
+    void MeasureVacuum()
+    {
+        system((std::string("cp ") + kPath + " " + kCopyPath).c_str());
+        ASSERT_THAT(sqlite3_open_v2(kCopyPath, &db, SQLITE_OPEN_READWRITE, kQuotaVfs), Eq(SQLITE_OK));
+        auto writes = QuotaVfsWrites();
+        auto start = std::chrono::steady_clock::now();
+        ASSERT_THAT(sqlite3_exec(db, kVacuum, 0, 0, 0), Eq(SQLITE_OK));
+        vacuumTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+        vacuumWrites = QuotaVfsWrites() - writes;
+        ASSERT_THAT(sqlite3_close_v2(db), Eq(SQLITE_OK));
+        db = nullptr;
+        system((std::string("rm -rf ") + kCopyPath).c_str());
+    }
+    // Runs sql over and over in a child process and SIGKILLs it after
+    // the given delay, leaving whatever a crash at that moment leaves.
+    void KillWhileRunning(const char* sql, sqlite3_int64 delayUs)
+    {
+        auto pid = fork();
+        ASSERT_THAT(pid, Gt(-1));
+        if (pid == 0) {
+            sqlite3* child;
+            sqlite3_open(kPath, &child);
+            for (;;) {
+                unlink(kVacuumPath);
+                sqlite3_exec(child, sql, 0, 0, 0);
+            }
+        }
+        usleep(delayUs);
+        kill(pid, SIGKILL);
+        int status;
+        ASSERT_THAT(waitpid(pid, &status, 0), Eq(pid));
+        EXPECT_TRUE(WIFSIGNALED(status));
+    }
+    // Runs sql once in a child process that is SIGKILLed at the given write.
+    void KillAtWrite(const char* sql, sqlite3_int64 write)
+    {
+        auto pid = fork();
+        ASSERT_THAT(pid, Gt(-1));
+        if (pid == 0) {
+            sqlite3* child;
+            sqlite3_open_v2(kPath, &child, SQLITE_OPEN_READWRITE, kQuotaVfs);
+            QuotaVfsKillAtWrite(QuotaVfsWrites() + write);
+            sqlite3_exec(child, sql, 0, 0, 0);
+            _exit(0);
+        }
+        int status;
+        ASSERT_THAT(waitpid(pid, &status, 0), Eq(pid));
+        EXPECT_TRUE(WIFSIGNALED(status));
+    }
+    // Runs sql with more free space each time until it fits, checking the
+    // reopened database after every SQLITE_FULL. Returns the most free
+    // space that still failed.
+    sqlite3_int64 FailUntilFits(const char* sql)
+    {
+        struct stat stat_buf;
+        EXPECT_THAT(stat(kPath, &stat_buf), Eq(0));
+        auto step = stat_buf.st_size / 32;
+        sqlite3_int64 free = 0;
+        for (;; free += step) {
+            QuotaVfsSetCapacity(QuotaVfsUsed() + free);
+            auto rc = sqlite3_exec(db, sql, 0, 0, 0);
+            QuotaVfsSetCapacity(kQuotaUnlimited);
+            if (rc != SQLITE_FULL) {
+                EXPECT_THAT(rc, Eq(SQLITE_OK));
+                return free - step;
+            }
+            unlink(kVacuumPath);
+            EXPECT_THAT(sqlite3_close_v2(db), Eq(SQLITE_OK));
+            EXPECT_THAT(sqlite3_open_v2(kPath, &db, SQLITE_OPEN_READWRITE, kQuotaVfs), Eq(SQLITE_OK));
+            EXPECT_THAT(sqlite3_exec(db, kIntegrityCheck, 0, 0, 0), Eq(SQLITE_OK));
+            EXPECT_THAT(Query(kCount), Eq(rows));
+            EXPECT_THAT(Query(kFreelistCount), Eq(freelist));
+        }
+    }
+};
+
+TEST_F(AFragmentedDb, IsIntactIfKilledDuringVacuum)
+{
+    MeasureVacuum();
+
+    auto journals = 0;
+    for (auto i = 0; i < 20; i++) {
+        KillWhileRunning(kVacuum, vacuumTime.count() * i / 16);
+        struct stat stat_buf;
+        if (stat(kJournalPath, &stat_buf) == 0) {
+            journals++;
+        }
+
+        ASSERT_THAT(sqlite3_open(kPath, &db), Eq(SQLITE_OK));
+        EXPECT_THAT(sqlite3_exec(db, kIntegrityCheck, 0, 0, 0), Eq(SQLITE_OK));
+        EXPECT_THAT(Query(kCount), Eq(rows));
+        EXPECT_THAT(sqlite3_close_v2(db), Eq(SQLITE_OK));
+        db = nullptr;
+    }
+    EXPECT_THAT(journals, Gt(0));
+}
+
+TEST_F(AFragmentedDb, IsIntactIfKilledDuringVacuumInto)
+{
+    MeasureVacuum();
+
+    for (auto i = 0; i < 20; i++) {
+        KillWhileRunning(kVacuumInto, vacuumTime.count() * i / 16);
+
+        ASSERT_THAT(sqlite3_open(kPath, &db), Eq(SQLITE_OK));
+        EXPECT_THAT(sqlite3_exec(db, kIntegrityCheck, 0, 0, 0), Eq(SQLITE_OK));
+        EXPECT_THAT(Query(kCount), Eq(rows));
+        EXPECT_THAT(Query(kFreelistCount), Eq(freelist));
+        EXPECT_THAT(sqlite3_close_v2(db), Eq(SQLITE_OK));
+        db = nullptr;
+    }
+}
+
+TEST_F(AFragmentedDb, IsIntactIfKilledDuringCopyBack)
+{
+    MeasureVacuum();
+
+    KillAtWrite(kVacuum, vacuumWrites * 3 / 4);
+    struct stat stat_buf;
+    ASSERT_THAT(stat(kJournalPath, &stat_buf), Eq(0));
+
+    ASSERT_THAT(sqlite3_open(kPath, &db), Eq(SQLITE_OK));
+    EXPECT_THAT(sqlite3_exec(db, kIntegrityCheck, 0, 0, 0), Eq(SQLITE_OK));
+    EXPECT_THAT(Query(kCount), Eq(rows));
+    EXPECT_THAT(Query(kFreelistCount), Eq(freelist));
+    EXPECT_THAT(sqlite3_close_v2(db), Eq(SQLITE_OK));
+    db = nullptr;
+    EXPECT_THAT(stat(kJournalPath, &stat_buf), Eq(-1));
+}
+
+TEST_F(AFragmentedDb, IsCorruptIfKilledDuringCopyBackWithTrashedJournal)
+{
+    MeasureVacuum();
+
+    KillAtWrite(kVacuum, vacuumWrites * 3 / 4);
+    struct stat stat_buf;
+    ASSERT_THAT(stat(kJournalPath, &stat_buf), Eq(0));
+    system((std::string("echo trash > ") + kJournalPath).c_str());
+
+    ASSERT_THAT(sqlite3_open(kPath, &db), Eq(SQLITE_OK));
+    EXPECT_THAT(sqlite3_exec(db, kIntegrityCheck, 0, 0, 0), Eq(SQLITE_OK));
+    EXPECT_THAT(QueryText(kIntegrityCheck), Ne("ok"));
+    EXPECT_THAT(Query(kCount), Eq(rows));
+    EXPECT_THAT(sqlite3_close_v2(db), Eq(SQLITE_OK));
+    db = nullptr;
+}
+
+TEST_F(AFragmentedDb, ReturnsFull13IfVacuumOnFullDisk)
+{
+    ASSERT_THAT(sqlite3_open_v2(kPath, &db, SQLITE_OPEN_READWRITE, kQuotaVfs), Eq(SQLITE_OK));
+
+    auto failed = FailUntilFits(kVacuum);
+
+    EXPECT_THAT(Query(kCount), Eq(rows));
+    EXPECT_THAT(Query(kFreelistCount), Eq(0));
+    EXPECT_THAT(sqlite3_close_v2(db), Eq(SQLITE_OK));
+    db = nullptr;
+    struct stat stat_buf;
+    ASSERT_THAT(stat(kPath, &stat_buf), Eq(0));
+    EXPECT_THAT(failed, Ge(stat_buf.st_size));
+}
+
+TEST_F(AFragmentedDb, ReturnsFull13IfVacuumIntoOnFullDisk)
+{
+    ASSERT_THAT(sqlite3_open_v2(kPath, &db, SQLITE_OPEN_READWRITE, kQuotaVfs), Eq(SQLITE_OK));
+
+    EXPECT_THAT(FailUntilFits(kVacuumInto), Gt(0));
+
+    EXPECT_THAT(sqlite3_close_v2(db), Eq(SQLITE_OK));
+    db = nullptr;
+    ASSERT_THAT(sqlite3_open(kVacuumPath, &db), Eq(SQLITE_OK));
+    EXPECT_THAT(sqlite3_exec(db, kIntegrityCheck, 0, 0, 0), Eq(SQLITE_OK));
+    EXPECT_THAT(Query(kCount), Eq(rows));
+    EXPECT_THAT(Query(kFreelistCount), Eq(0));
+    EXPECT_THAT(sqlite3_close_v2(db), Eq(SQLITE_OK));
+    db = nullptr;
+}
+
+TEST_F(AFragmentedDb, ReturnsFull13IfIncrementalVacuumOnFullDisk)
+{
+    ASSERT_THAT(sqlite3_open_v2(kPath, &db, SQLITE_OPEN_READWRITE, kQuotaVfs), Eq(SQLITE_OK));
+
+    EXPECT_THAT(FailUntilFits(kIncrementalVacuum), Gt(0));
+
+    EXPECT_THAT(Query(kCount), Eq(rows));
+    EXPECT_THAT(Query(kFreelistCount), Eq(0));
+    EXPECT_THAT(sqlite3_close_v2(db), Eq(SQLITE_OK));
+    db = nullptr;
+}
+
+TEST_F(AFragmentedDb, ReturnsIoerr10IfVacuumWithEmptyJournalFolder)
+{
+    system((std::string("mkdir -p ") + kJournalPath).c_str());
+
+    ASSERT_THAT(sqlite3_open(kPath, &db), Eq(SQLITE_OK));
+    EXPECT_THAT(sqlite3_exec(db, kVacuum, 0, 0, 0), Eq(SQLITE_IOERR));
+    EXPECT_THAT(sqlite3_exec(db, kIncrementalVacuum, 0, 0, 0), Eq(SQLITE_IOERR));
+    EXPECT_THAT(sqlite3_close_v2(db), Eq(SQLITE_OK));
+    db = nullptr;
+
+    system((std::string("rm -rf ") + kJournalPath).c_str());
+
+    ASSERT_THAT(sqlite3_open(kPath, &db), Eq(SQLITE_OK));
+    EXPECT_THAT(sqlite3_exec(db, kIntegrityCheck, 0, 0, 0), Eq(SQLITE_OK));
+    EXPECT_THAT(Query(kCount), Eq(rows));
+    EXPECT_THAT(Query(kFreelistCount), Eq(freelist));
+    EXPECT_THAT(sqlite3_close_v2(db), Eq(SQLITE_OK));
+    db = nullptr;
+}
+
+TEST_F(AFragmentedDb, WorksIfVacuumWithCorruptJournalFile)
+{
+    system((std::string("echo trash > ") + kJournalPath).c_str());
+
+    ASSERT_THAT(sqlite3_open(kPath, &db), Eq(SQLITE_OK));
+    EXPECT_THAT(sqlite3_exec(db, kVacuum, 0, 0, 0), Eq(SQLITE_OK));
+    EXPECT_THAT(sqlite3_exec(db, kIntegrityCheck, 0, 0, 0), Eq(SQLITE_OK));
+    EXPECT_THAT(Query(kCount), Eq(rows));
+    EXPECT_THAT(Query(kFreelistCount), Eq(0));
+    EXPECT_THAT(sqlite3_close_v2(db), Eq(SQLITE_OK));
+    db = nullptr;
+}
+
+// Prints file size, free pages and full scan time around a VACUUM.
+TEST_F(AFragmentedDb, ShrinksIfVacuum)
+{
+    struct stat before;
+    struct stat after;
+    ASSERT_THAT(stat(kPath, &before), Eq(0));
+    ASSERT_THAT(sqlite3_open(kPath, &db), Eq(SQLITE_OK));
+    auto start = std::chrono::steady_clock::now();
+    auto length = Query(kScan);
+    auto scanBefore = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+    EXPECT_THAT(sqlite3_exec(db, kVacuum, 0, 0, 0), Eq(SQLITE_OK));
+    EXPECT_THAT(sqlite3_close_v2(db), Eq(SQLITE_OK));
+    db = nullptr;
+
+    ASSERT_THAT(stat(kPath, &after), Eq(0));
+    ASSERT_THAT(sqlite3_open(kPath, &db), Eq(SQLITE_OK));
+    start = std::chrono::steady_clock::now();
+    EXPECT_THAT(Query(kScan), Eq(length));
+    auto scanAfter = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+    EXPECT_THAT(Query(kFreelistCount), Eq(0));
+    EXPECT_THAT(sqlite3_close_v2(db), Eq(SQLITE_OK));
+    db = nullptr;
+
+    EXPECT_THAT(after.st_size, Lt(before.st_size));
+    std::cout << "before vacuum: " << before.st_size << " bytes, " << freelist << " free pages, "
+              << scanBefore.count() << " us/scan" << std::endl;
+    std::cout << "after vacuum: " << after.st_size << " bytes, 0 free pages, "
+              << scanAfter.count() << " us/scan" << std::endl;
+}
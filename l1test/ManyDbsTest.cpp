@@ -0,0 +1,245 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <dirent.h>
+#include <fstream>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <iostream>
+#include <sqlite3.h>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <vector>
+
+using ::testing::Eq;
+using ::testing::Gt;
+using ::testing::Le;
+using ::testing::Test;
+
+const auto kDir = "/tmp/sqlitetest-many";
+const auto kTemplatePath = "/tmp/sqlitetest-many/template";
+const auto kHotPath = "/tmp/sqlitetest-many/hot";
+const auto kSchema = "create table if not exists t (i text unique);";
+const auto kInsert = "insert into t (i) values ('abc');";
+const auto kSelect = "select * from t;";
+const auto kSpill = "pragma cache_size = 1; begin; "
+                    "with recursive n(x) as (select 1 union all select x + 1 from n where x < 100) "
+                    "insert into t (i) select hex(randomblob(512)) from n;";
+const auto kRollback = "rollback;";
+
+enum State {
+    kOk,
+    kEmpty,
+    kTrash,
+    kHotJournal,
+    kCorruptJournal,
+    kJournalFolder,
+    kStates
+};
+const char* kStateNames[] = { "ok", "empty", "trash", "hot journal", "corrupt journal", "journal folder" };
+const char* kStateEnvs[] = { "", "SQLITETEST_FAULTY_EMPTY", "SQLITETEST_FAULTY_TRASH", "SQLITETEST_FAULTY_HOT_JOURNAL",
+    "SQLITETEST_FAULTY_CORRUPT_JOURNAL", "SQLITETEST_FAULTY_JOURNAL_FOLDER" };
+const int kExpected[] = { SQLITE_OK, SQLITE_OK, SQLITE_NOTADB, SQLITE_OK, SQLITE_OK, SQLITE_IOERR };
+const auto kCount = "select count(*) from t;";
+
+// Opens every database like a process at boot and keeps the connections.
+class ManyDbs : public Test {
+protected:
+    int count;
+    int threads;
+    std::vector<State> states;
+    void SetUp() override
+    {
+        count = Env("SQLITETEST_DBS", 100);
+        threads = Env("SQLITETEST_THREADS", 4);
+        int faults[kStates] = {};
+        auto faulty = 0;
+        for (auto s = kEmpty; s < kStates; s = static_cast<State>(s + 1)) {
+            faults[s] = static_cast<int>(count * Env(kStateEnvs[s], 0.02) + 0.5);
+            faulty += faults[s];
+        }
+        ASSERT_THAT(count, Gt(0));
+        ASSERT_THAT(threads, Gt(0));
+        ASSERT_THAT(faulty, Le(count));
+        system((std::string("rm -rf ") + kDir).c_str());
+        system((std::string("mkdir -p ") + kDir).c_str());
+
+        sqlite3* db;
+        ASSERT_THAT(sqlite3_open(kTemplatePath, &db), Eq(SQLITE_OK));
+        ASSERT_THAT(sqlite3_exec(db, kSchema, 0, 0, 0), Eq(SQLITE_OK));
+        ASSERT_THAT(sqlite3_exec(db, kInsert, 0, 0, 0), Eq(SQLITE_OK));
+        ASSERT_THAT(sqlite3_exec(db, kSpill, 0, 0, 0), Eq(SQLITE_OK));
+        struct stat stat_buf;
+        ASSERT_THAT(stat((std::string(kTemplatePath) + "-journal").c_str(), &stat_buf), Eq(0));
+        Copy(kTemplatePath, kHotPath);
+        Copy(std::string(kTemplatePath) + "-journal", std::string(kHotPath) + "-journal");
+        ASSERT_THAT(sqlite3_exec(db, kRollback, 0, 0, 0), Eq(SQLITE_OK));
+        ASSERT_THAT(sqlite3_close_v2(db), Eq(SQLITE_OK));
+
+        // Faulty databases sit at even intervals, and the states take turns
+        // in proportion to their counts.
+        states.assign(count, kOk);
+        int turn[kStates] = {};
+        for (auto f = 0; f < faulty; f++) {
+            auto state = kEmpty;
+            for (auto s = kEmpty; s < kStates; s = static_cast<State>(s + 1)) {
+                turn[s] += faults[s];
+                if (turn[s] > turn[state]) {
+                    state = s;
+                }
+            }
+            turn[state] -= faulty;
+            states[(2 * f + 1) * count / (2 * faulty)] = state;
+        }
+        for (auto i = 0; i < count; i++) {
+            auto state = states[i];
+            auto path = Path(i);
+            switch (state) {
+            case kOk:
+                Copy(kTemplatePath, path);
+                break;
+            case kEmpty:
+                std::ofstream(path.c_str());
+                break;
+            case kTrash:
+                std::ofstream(path.c_str()) << "trash" << std::endl;
+                break;
+            case kHotJournal:
+                Copy(kHotPath, path);
+                Copy(std::string(kHotPath) + "-journal", path + "-journal");
+                break;
+            case kCorruptJournal:
+                Copy(kTemplatePath, path);
+                std::ofstream((path + "-journal").c_str()) << "trash" << std::endl;
+                break;
+            case kJournalFolder:
+                Copy(kTemplatePath, path);
+                mkdir((path + "-journal").c_str(), 0755);
+                break;
+            default:
+                break;
+            }
+        }
+    }
+    static double Env(const char* name, double value)
+    {
+        auto env = getenv(name);
+        return env ? atof(env) : value;
+    }
+    static void Copy(const std::string& from, const std::string& to)
+    {
+        std::ifstream in(from.c_str(), std::ios::binary);
+        std::ofstream out(to.c_str(), std::ios::binary);
+        out << in.rdbuf();
+    }
+    static std::string Path(int i)
+    {
+        return std::string(kDir) + "/" + std::to_string(i);
+    }
+    static int Count(sqlite3* db)
+    {
+        sqlite3_stmt* stmt;
+        sqlite3_prepare_v2(db, kCount, -1, &stmt, 0);
+        auto result = (sqlite3_step(stmt) == SQLITE_ROW) ? sqlite3_column_int(stmt, 0) : -1;
+        sqlite3_finalize(stmt);
+        return result;
+    }
+    static int OpenFds()
+    {
+        auto result = 0;
+        auto dir = opendir("/proc/self/fd");
+        if (dir) {
+            while (readdir(dir)) {
+                result++;
+            }
+            closedir(dir);
+        }
+        return result - 3; // ".", ".." and the directory itself
+    }
+    static long RssKb()
+    {
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        while (std::getline(status, line)) {
+            if (line.compare(0, 6, "VmRSS:") == 0) {
+                return atol(line.c_str() + 6);
+            }
+        }
+        return -1;
+    }
+    void Boot(int poolSize)
+    {
+        std::vector<sqlite3*> dbs(count);
+        std::vector<int> results(count);
+        std::vector<std::chrono::microseconds> latencies(count);
+        std::atomic<int> next(0);
+        auto fds = OpenFds();
+        auto rss = RssKb();
+
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> pool;
+        for (auto t = 0; t < poolSize; t++) {
+            pool.emplace_back([&]() {
+                for (int i; (i = next++) < count;) {
+                    auto openStart = std::chrono::steady_clock::now();
+                    results[i] = sqlite3_open(Path(i).c_str(), &dbs[i]);
+                    if (results[i] == SQLITE_OK) {
+                        results[i] = sqlite3_exec(dbs[i], kSchema, 0, 0, 0);
+                    }
+                    if (results[i] == SQLITE_OK) {
+                        results[i] = sqlite3_exec(dbs[i], kSelect, 0, 0, 0);
+                    }
+                    latencies[i] = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - openStart);
+                }
+            });
+        }
+        for (auto& thread : pool) {
+            thread.join();
+        }
+        auto boot = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+        fds = OpenFds() - fds;
+        rss = RssKb() - rss;
+        auto memory = sqlite3_memory_used();
+
+        for (auto i = 0; i < count; i++) {
+            EXPECT_THAT(results[i], Eq(kExpected[states[i]])) << Path(i) << " " << kStateNames[states[i]];
+            if (states[i] == kHotJournal) {
+                struct stat stat_buf;
+                EXPECT_THAT(Count(dbs[i]), Eq(1)) << Path(i);
+                EXPECT_THAT(stat((Path(i) + "-journal").c_str(), &stat_buf), Eq(-1)) << Path(i);
+            }
+            EXPECT_THAT(sqlite3_close_v2(dbs[i]), Eq(SQLITE_OK));
+        }
+
+        std::chrono::microseconds slowest[kStates] = {};
+        int dbsInState[kStates] = {};
+        for (auto i = 0; i < count; i++) {
+            slowest[states[i]] = std::max(slowest[states[i]], latencies[i]);
+            dbsInState[states[i]]++;
+        }
+        std::sort(latencies.begin(), latencies.end());
+        std::cout << count << " dbs, " << poolSize << " threads: " << boot.count() << " us, "
+                  << "p50 " << latencies[count * 50 / 100].count() << " us, "
+                  << "p90 " << latencies[count * 90 / 100].count() << " us, "
+                  << "p99 " << latencies[count * 99 / 100].count() << " us, "
+                  << "max " << latencies.back().count() << " us, "
+                  << fds << " fds, " << rss << " kB rss, " << memory / 1024 << " kB sqlite" << std::endl;
+        for (auto s = 0; s < kStates; s++) {
+            if (dbsInState[s] > 0) {
+                std::cout << dbsInState[s] << " " << kStateNames[s] << ", slowest " << slowest[s].count() << " us" << std::endl;
+            }
+        }
+    }
+};
+
+TEST_F(ManyDbs, WorksIfOpenSerially)
+{
+    Boot(1);
+}
+
+TEST_F(ManyDbs, WorksIfOpenInParallel)
+{
+    Boot(threads);
+}
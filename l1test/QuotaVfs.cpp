@@ -0,0 +1,169 @@
+#include "QuotaVfs.h"
+
+#include <csignal>
+#include <set>
+
+namespace {
+
+struct QuotaFile {
+    sqlite3_file base;
+    sqlite3_file* real;
+};
+
+sqlite3_vfs* root;
+sqlite3_vfs vfs;
+sqlite3_int64 capacity = kQuotaUnlimited;
+std::set<QuotaFile*> files;
+sqlite3_int64 writes;
+sqlite3_int64 killAt = -1;
+
+sqlite3_file* real(sqlite3_file* f)
+{
+    return reinterpret_cast<QuotaFile*>(f)->real;
+}
+
+int quotaClose(sqlite3_file* f)
+{
+    files.erase(reinterpret_cast<QuotaFile*>(f));
+    return real(f)->pMethods->xClose(real(f));
+}
+
+int quotaRead(sqlite3_file* f, void* buf, int amt, sqlite3_int64 off)
+{
+    return real(f)->pMethods->xRead(real(f), buf, amt, off);
+}
+
+int quotaWrite(sqlite3_file* f, const void* buf, int amt, sqlite3_int64 off)
+{
+    if (++writes == killAt) {
+        raise(SIGKILL);
+    }
+    sqlite3_int64 size;
+    auto rc = real(f)->pMethods->xFileSize(real(f), &size);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    if (off + amt > size && QuotaVfsUsed() + off + amt - size > capacity) {
+        return SQLITE_FULL;
+    }
+    return real(f)->pMethods->xWrite(real(f), buf, amt, off);
+}
+
+int quotaTruncate(sqlite3_file* f, sqlite3_int64 size)
+{
+    return real(f)->pMethods->xTruncate(real(f), size);
+}
+
+int quotaSync(sqlite3_file* f, int flags)
+{
+    return real(f)->pMethods->xSync(real(f), flags);
+}
+
+int quotaFileSize(sqlite3_file* f, sqlite3_int64* size)
+{
+    return real(f)->pMethods->xFileSize(real(f), size);
+}
+
+int quotaLock(sqlite3_file* f, int lock)
+{
+    return real(f)->pMethods->xLock(real(f), lock);
+}
+
+int quotaUnlock(sqlite3_file* f, int lock)
+{
+    return real(f)->pMethods->xUnlock(real(f), lock);
+}
+
+int quotaCheckReservedLock(sqlite3_file* f, int* out)
+{
+    return real(f)->pMethods->xCheckReservedLock(real(f), out);
+}
+
+int quotaFileControl(sqlite3_file* f, int op, void* arg)
+{
+    return real(f)->pMethods->xFileControl(real(f), op, arg);
+}
+
+int quotaSectorSize(sqlite3_file* f)
+{
+    return real(f)->pMethods->xSectorSize(real(f));
+}
+
+int quotaDeviceCharacteristics(sqlite3_file* f)
+{
+    return real(f)->pMethods->xDeviceCharacteristics(real(f));
+}
+
+// Version 1: no shared memory, so the rollback journal is always used.
+const sqlite3_io_methods kMethods = {
+    1,
+    quotaClose,
+    quotaRead,
+    quotaWrite,
+    quotaTruncate,
+    quotaSync,
+    quotaFileSize,
+    quotaLock,
+    quotaUnlock,
+    quotaCheckReservedLock,
+    quotaFileControl,
+    quotaSectorSize,
+    quotaDeviceCharacteristics,
+};
+
+int quotaOpen(sqlite3_vfs*, const char* name, sqlite3_file* f, int flags, int* outFlags)
+{
+    auto p = reinterpret_cast<QuotaFile*>(f);
+    p->real = reinterpret_cast<sqlite3_file*>(p + 1);
+    auto rc = root->xOpen(root, name, p->real, flags, outFlags);
+    if (p->real->pMethods) {
+        p->base.pMethods = &kMethods;
+        files.insert(p);
+    } else {
+        p->base.pMethods = nullptr;
+    }
+    return rc;
+}
+
+}
+
+void QuotaVfsRegister()
+{
+    if (sqlite3_vfs_find(kQuotaVfs)) {
+        return;
+    }
+    root = sqlite3_vfs_find(nullptr);
+    vfs = *root;
+    vfs.pNext = nullptr;
+    vfs.zName = kQuotaVfs;
+    vfs.szOsFile = sizeof(QuotaFile) + root->szOsFile;
+    vfs.xOpen = quotaOpen;
+    sqlite3_vfs_register(&vfs, 0);
+}
+
+void QuotaVfsSetCapacity(sqlite3_int64 bytes)
+{
+    capacity = bytes;
+}
+
+sqlite3_int64 QuotaVfsUsed()
+{
+    sqlite3_int64 used = 0;
+    for (auto p : files) {
+        sqlite3_int64 size;
+        if (p->real->pMethods->xFileSize(p->real, &size) == SQLITE_OK) {
+            used += size;
+        }
+    }
+    return used;
+}
+
+sqlite3_int64 QuotaVfsWrites()
+{
+    return writes;
+}
+
+void QuotaVfsKillAtWrite(sqlite3_int64 write)
+{
+    killAt = write;
+}
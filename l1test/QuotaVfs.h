@@ -0,0 +1,16 @@
+#pragma once
+
+#include <sqlite3.h>
+
+// A VFS named "quota" that wraps the default one and fails writes with
+// SQLITE_FULL (what the unix VFS returns on ENOSPC) once the files it has
+// open would grow beyond the capacity. Closed files release their space.
+// It also counts writes and can SIGKILL the process at a given one.
+const auto kQuotaVfs = "quota";
+const sqlite3_int64 kQuotaUnlimited = 1LL << 62;
+
+void QuotaVfsRegister();
+void QuotaVfsSetCapacity(sqlite3_int64 bytes);
+sqlite3_int64 QuotaVfsUsed();
+sqlite3_int64 QuotaVfsWrites();
+void QuotaVfsKillAtWrite(sqlite3_int64 write);